@@ -5,7 +5,22 @@
 //
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #define GLEW_STATIC                                                            \
   1 // This allows linking with Static Library on Windows, without DLL
@@ -24,8 +39,6 @@
 using namespace glm;
 using namespace std;
 
-GLuint loadTexture(const char *filename);
-
 const char *getVertexShaderSource();
 
 const char *getFragmentShaderSource();
@@ -137,9 +150,367 @@ const TexturedColoredVertex texturedCubeVertexArray[] = { // position, color
 };
 
 
+// GPU memory residency
+// Every texture and buffer created by the app is registered here with its
+// size. When usage goes over the budget, the least recently used textures
+// are shrunk to their lower mip levels; binding a shrunk texture reloads the
+// full image from disk on a loader thread and uploads it in update().
+class GpuResidencyManager {
+public:
+  explicit GpuResidencyManager(size_t budgetBytes);
+  ~GpuResidencyManager();
+
+  // Load an image file into a mipmapped texture and start tracking it
+  GLuint loadTexture(const char *filename);
+
+  // glBindTexture(GL_TEXTURE_2D, ...) that also marks the texture as used
+  void bindTexture(GLuint textureId);
+
+  void trackBuffer(GLuint bufferId, size_t bytes);
+  void untrackBuffer(GLuint bufferId);
+
+  // Call once per frame: uploads finished reloads and enforces the budget
+  void update();
+
+  void setBudget(size_t budgetBytes) { budget = budgetBytes; }
+  size_t getBudget() const { return budget; }
+  size_t getUsage() const { return textureBytes + bufferBytes; }
+  size_t getTextureBytes() const { return textureBytes; }
+  size_t getBufferBytes() const { return bufferBytes; }
+  long long getEvictionCount() const { return evictionCount; }
+  long long getReloadCount() const { return reloadCount; }
+
+  void printStats(std::ostream &out);
+
+  // Stop the loader thread and delete all textures (needs the GL context)
+  void shutdown();
+
+  // Mip levels dropped per eviction, and smallest size a texture shrinks to
+  int evictionMipStep = 2;
+  int minResidentSize = 16;
+  // Frames to wait before decoding again after a reload did not fit
+  long long reloadRetryFrames = 120;
+  // Full size reloads uploaded per frame, each one regenerates its mipmaps
+  int maxReloadsPerFrame = 1;
+  // Shrinks per frame, each one reads a mip back and regenerates mipmaps, so
+  // going over budget is caught up over several frames instead of one
+  int maxEvictionsPerFrame = 2;
+
+private:
+  struct TextureResidency {
+    std::string filename;
+    int width, height, channels;
+    int levelCount;    // mip levels of the full image
+    int residentLevel; // first mip level of the full image on the GPU
+    int lowestLevel;   // residentLevel can't go past this
+    size_t bytes;
+    long long lastUsedFrame;
+    long long reloadRetryFrame;
+    bool reloadPending;
+  };
+
+  struct TextureImage {
+    GLuint textureId;
+    int width, height, channels;
+    unsigned char *data;
+  };
+
+  void loaderLoop();
+  void stopLoader();
+  size_t bytesFromLevel(const TextureResidency &texture, int level) const;
+  void shrinkTexture(GLuint textureId, TextureResidency &texture, int level);
+  bool evictUntil(size_t targetUsage, GLuint keepTextureId, bool staleOnly);
+  bool reloadCanFit(GLuint textureId, const TextureResidency &texture) const;
+
+  size_t budget;
+  size_t textureBytes = 0;
+  size_t bufferBytes = 0;
+  long long evictionCount = 0;
+  long long reloadCount = 0;
+  long long frame = 0;
+  int evictionsThisFrame = 0;
+  std::map<GLuint, TextureResidency> textures;
+  std::map<GLuint, size_t> buffers;
+
+  // Shared with the loader thread, protected by loaderMutex
+  std::mutex loaderMutex;
+  std::condition_variable loaderCondition;
+  std::deque<std::pair<GLuint, std::string>> reloadRequests;
+  std::deque<TextureImage> reloadedImages;
+  bool stopping = false;
+  std::thread loader;
+};
+
+void uploadTextureImage(GLuint textureId, int width, int height,
+                        int nrChannels, const unsigned char *data);
+
+int createTexturedCubeVertexArrayObject(GpuResidencyManager &residency);
+
+// Voxel world
+// The ground is a grid of CHUNK_SIZE x CHUNK_HEIGHT x CHUNK_SIZE chunks of
+// unit cubes (same size as the cube model). Worker threads generate and
+// greedy-mesh chunks into TexturedColoredVertex triangles, the main thread
+// uploads a few finished chunks per frame and evicts chunks that fall out of
+// range of the camera.
+const int CHUNK_SIZE = 16;
+const int CHUNK_HEIGHT = 16;
+const int VOXEL_GROUND_LEVEL = 4;                 // height of the flat ground
+const float VOXEL_WORLD_BASE_Y = -0.5f - VOXEL_GROUND_LEVEL; // ground top at y = -0.5
+
+enum VoxelType : unsigned char { VOXEL_AIR = 0, VOXEL_CEMENT, VOXEL_BRICK };
+
+// Output of a worker thread, waiting to be uploaded by the main thread
+struct VoxelChunkBuild {
+  int chunkX, chunkZ;
+  std::vector<TexturedColoredVertex> vertices; // cement quads, then brick quads
+  int cementVertexCount;
+  int brickVertexCount;
+};
+
+// A chunk whose mesh lives on the GPU
+struct VoxelChunk {
+  GLuint vertexArrayObject;
+  GLuint vertexBufferObject;
+  int cementVertexCount;
+  int brickVertexCount;
+};
+
+class VoxelWorld {
+public:
+  VoxelWorld(int loadRadius, int workerCount, GpuResidencyManager &residency);
+  ~VoxelWorld();
+
+  // Request chunks around cameraPosition, evict far chunks and upload at
+  // most maxUploadsPerFrame / maxUploadBytesPerFrame of finished meshes
+  void update(vec3 cameraPosition);
+
+  // Draw resident chunks, expects the textured shader to be in use
+  void draw(int shaderProgram, GLuint cementTextureID, GLuint brickTextureID);
+
+  void printStats(std::ostream &out);
+
+  // Stop the workers and delete all GPU buffers (needs the GL context)
+  void shutdown();
+
+  int maxUploadsPerFrame = 4;
+  size_t maxUploadBytesPerFrame = 2 * 1024 * 1024;
+
+private:
+  typedef std::pair<int, int> ChunkCoord;
+
+  void workerLoop();
+  void uploadChunk(VoxelChunkBuild &build);
+  void deleteChunk(VoxelChunk &chunk);
+
+  int loadRadius;
+  ChunkCoord centerChunk;
+  GpuResidencyManager &residency;
+
+  // Main thread only
+  std::map<ChunkCoord, VoxelChunk> residentChunks;
+  std::set<ChunkCoord> requestedChunks; // queued or being meshed
+  size_t residentVertexBytes = 0;
+  std::chrono::steady_clock::time_point startTime;
+
+  // Shared with workers, protected by queueMutex
+  std::mutex queueMutex;
+  std::condition_variable queueCondition;
+  std::deque<ChunkCoord> pendingChunks;
+  std::deque<VoxelChunkBuild> finishedChunks;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  // Meshing throughput counters, updated by workers
+  std::atomic<long long> chunksMeshed{0};
+  std::atomic<long long> quadsMeshed{0};
+  std::atomic<long long> meshingNanoseconds{0};
+};
+
+unsigned char generateVoxel(int worldX, int worldY, int worldZ);
+
+void greedyMeshChunk(int chunkX, int chunkZ,
+                     const std::vector<unsigned char> &paddedVoxels,
+                     VoxelChunkBuild &build, long long &quadCount);
+
+// Entity/component store
+// Entities are plain ids. Each component type lives in its own sparse set: a
+// packed array of components (iterated by systems) plus an entity -> index
+// table for lookups. Systems declare which component types they read and
+// write, and the scheduler runs systems whose sets don't overlap in parallel.
+typedef unsigned int Entity;
+const Entity INVALID_ENTITY = ~0u;
+const unsigned int INVALID_COMPONENT_INDEX = ~0u;
+
+enum ComponentType : unsigned int {
+  COMPONENT_TRANSFORM = 1 << 0,
+  COMPONENT_ORBIT = 1 << 1,
+  COMPONENT_SPIN = 1 << 2,
+  COMPONENT_RENDERABLE = 1 << 3,
+  COMPONENT_CAMERA = 1 << 4
+};
+
+// worldMatrix = parent * translate(position) * rotateY(rotationY) *
+//               scale(scale) * translate(offset) * spin
+struct TransformComponent {
+  vec3 position;
+  float rotationY; // radians
+  vec3 scale;
+  vec3 offset; // in scaled space, like the car parts relative to the body
+  Entity parent;
+  int depth; // parent depth + 1, parents are updated first
+  mat4 worldMatrix;
+};
+
+// Circle around the origin in the xz plane, facing along the path
+struct OrbitComponent {
+  float radius;
+  float angle; // radians
+  float speed; // radians per second
+};
+
+struct SpinComponent {
+  vec3 axis;
+  float angle; // radians
+  float speed; // radians per second
+};
+
+// Textured cube vertices to draw with the entity's world matrix
+struct RenderableComponent {
+  GLuint textureId;
+  int firstVertex;
+  int vertexCount;
+};
+
+struct CameraComponent {
+  vec3 lookAt;
+  vec3 up;
+  float speed;
+  float fastSpeed;
+  float horizontalAngle; // degrees
+  float verticalAngle;   // degrees
+  bool firstPerson;
+  mat4 viewMatrix;
+};
+
+template <typename T> class ComponentArray {
+public:
+  T &add(Entity entity, const T &component) {
+    if (has(entity))
+      return components[sparse[entity]] = component;
+    if (entity >= sparse.size())
+      sparse.resize(entity + 1, INVALID_COMPONENT_INDEX);
+    sparse[entity] = (unsigned int)components.size();
+    components.push_back(component);
+    entities.push_back(entity);
+    return components.back();
+  }
+
+  // Swap the last component into the hole to keep the array packed
+  void remove(Entity entity) {
+    if (!has(entity))
+      return;
+    unsigned int index = sparse[entity];
+    Entity last = entities.back();
+    components[index] = components.back();
+    entities[index] = last;
+    sparse[last] = index;
+    components.pop_back();
+    entities.pop_back();
+    sparse[entity] = INVALID_COMPONENT_INDEX;
+  }
+
+  bool has(Entity entity) const {
+    return entity < sparse.size() && sparse[entity] != INVALID_COMPONENT_INDEX;
+  }
+  T &get(Entity entity) { return components[sparse[entity]]; }
+
+  size_t size() const { return components.size(); }
+  T &componentAt(size_t index) { return components[index]; }
+  Entity entityAt(size_t index) const { return entities[index]; }
+
+  void reserve(size_t count) {
+    components.reserve(count);
+    entities.reserve(count);
+    sparse.reserve(count);
+  }
+
+private:
+  std::vector<T> components;
+  std::vector<Entity> entities;
+  std::vector<unsigned int> sparse;
+};
 
+struct Scene {
+  Entity createEntity();
+  // Also destroys the entity's transform children
+  void destroyEntity(Entity entity);
+  bool isAlive(Entity entity) const {
+    return entity < aliveEntities.size() && aliveEntities[entity];
+  }
 
-int createTexturedCubeVertexArrayObject();
+  // Adds a transform, children must be created after their parent
+  TransformComponent &addTransform(Entity entity, vec3 position,
+                                   vec3 scale = vec3(1.0f),
+                                   vec3 offset = vec3(0.0f),
+                                   Entity parent = INVALID_ENTITY);
+
+  ComponentArray<TransformComponent> transforms;
+  ComponentArray<OrbitComponent> orbits;
+  ComponentArray<SpinComponent> spins;
+  ComponentArray<RenderableComponent> renderables;
+  ComponentArray<CameraComponent> cameras;
+
+  Entity nextEntity = 0;
+  std::vector<Entity> freeEntities;
+  std::vector<bool> aliveEntities;
+};
+
+class SystemScheduler {
+public:
+  // With no workers every system runs on the calling thread
+  explicit SystemScheduler(int workerCount);
+  ~SystemScheduler();
+
+  // Systems that conflict run in the order they were added
+  void addSystem(const char *name, unsigned int reads, unsigned int writes,
+                 std::function<void(Scene &, float)> update);
+
+  void run(Scene &scene, float dt);
+
+  void printStats(std::ostream &out);
+
+private:
+  struct System {
+    const char *name;
+    unsigned int reads, writes;
+    std::function<void(Scene &, float)> update;
+    int batch;
+    double lastRunMilliseconds;
+  };
+
+  void workerLoop();
+  void runSystem(System &system, Scene &scene, float dt);
+
+  std::vector<System> systems;
+  int batchCount = 0;
+
+  // Shared with workers, protected by taskMutex
+  std::mutex taskMutex;
+  std::condition_variable taskCondition;
+  std::condition_variable doneCondition;
+  std::deque<std::function<void()>> tasks;
+  int tasksRemaining = 0;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
+
+// Orbit, spin, transform and camera systems, in that order
+void addSceneSystems(SystemScheduler &scheduler);
+
+void drawRenderables(Scene &scene, int shaderProgram,
+                     GpuResidencyManager &residency);
+
+int runEcsBenchmark(int entityCount);
 
 void setProjectionMatrix(int shaderProgram, mat4 projectionMatrix) {
   glUseProgram(shaderProgram);
@@ -163,6 +534,12 @@ void setWorldMatrix(int shaderProgram, mat4 worldMatrix) {
 }
 
 int main(int argc, char *argv[]) {
+  // Run the entity store benchmark instead of the scene
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--bench-ecs") == 0)
+      return runEcsBenchmark(1000000);
+  }
+
   // Initialize GLFW and OpenGL version
   glfwInit();
 
@@ -196,15 +573,24 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  // All textures and buffers go through the residency manager, which keeps
+  // GPU memory under budget (override with --vram-budget-mb <size>)
+  size_t vramBudgetMB = 256;
+  for (int i = 1; i + 1 < argc; ++i) {
+    if (strcmp(argv[i], "--vram-budget-mb") == 0)
+      vramBudgetMB = strtoul(argv[i + 1], NULL, 10);
+  }
+  GpuResidencyManager residency(vramBudgetMB * 1024 * 1024);
+
   // Load Textures
-  GLuint brickTextureID = loadTexture("Textures/brick.jpg");
-  GLuint cementTextureID = loadTexture("Textures/cement.jpg");
-  GLuint sky_posx = loadTexture("Skybox/posx.jpg");
-  GLuint sky_negx = loadTexture("Skybox/negx.jpg");
-  GLuint sky_posy = loadTexture("Skybox/posy.jpg");
-  GLuint sky_negy = loadTexture("Skybox/negy.jpg");
-  GLuint sky_posz = loadTexture("Skybox/posz.jpg");
-  GLuint sky_negz = loadTexture("Skybox/negz.jpg");
+  GLuint brickTextureID = residency.loadTexture("Textures/brick.jpg");
+  GLuint cementTextureID = residency.loadTexture("Textures/cement.jpg");
+  GLuint sky_posx = residency.loadTexture("Skybox/posx.jpg");
+  GLuint sky_negx = residency.loadTexture("Skybox/negx.jpg");
+  GLuint sky_posy = residency.loadTexture("Skybox/posy.jpg");
+  GLuint sky_negy = residency.loadTexture("Skybox/negy.jpg");
+  GLuint sky_posz = residency.loadTexture("Skybox/posz.jpg");
+  GLuint sky_negz = residency.loadTexture("Skybox/negz.jpg");
   // Black background
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
@@ -214,20 +600,56 @@ int main(int argc, char *argv[]) {
   int texturedShaderProgram = compileAndLinkShaders(
       getTexturedVertexShaderSource(), getTexturedFragmentShaderSource());
 
-  // Camera parameters for view transform
-  vec3 cameraPosition(0.6f, 1.0f, 10.0f);
-  vec3 cameraLookAt(0.0f, 0.0f, -1.0f);
-  vec3 cameraUp(0.0f, 1.0f, 0.0f);
-
-  // Other camera parameters
-  float cameraSpeed = 1.0f;
-  float cameraFastSpeed = 10 * cameraSpeed;
-  float cameraHorizontalAngle = 90.0f;
-  float cameraVerticalAngle = 0.0f;
-  bool cameraFirstPerson = true; // press 1 or 2 to toggle this variable
-
-  // Spinning cube at camera position
-  float spinningCubeAngle = 0.0f;
+  // Scene entities and the systems that update them each frame
+  Scene scene;
+  SystemScheduler scheduler(
+      std::max(1, int(std::thread::hardware_concurrency()) - 1));
+  addSceneSystems(scheduler);
+
+  // Camera, with the spinning cube avatar at its position
+  Entity cameraEntity = scene.createEntity();
+  scene.addTransform(cameraEntity, vec3(0.6f, 1.0f, 10.0f), vec3(0.1f));
+  CameraComponent playerCamera;
+  playerCamera.lookAt = vec3(0.0f, 0.0f, -1.0f);
+  playerCamera.up = vec3(0.0f, 1.0f, 0.0f);
+  playerCamera.speed = 1.0f;
+  playerCamera.fastSpeed = 10 * playerCamera.speed;
+  playerCamera.horizontalAngle = 90.0f;
+  playerCamera.verticalAngle = 0.0f;
+  playerCamera.firstPerson = true; // press 1 or 2 to toggle this variable
+  playerCamera.viewMatrix = mat4(1.0f);
+  scene.cameras.add(cameraEntity, playerCamera);
+  SpinComponent cubeSpin = {vec3(0.0f, 1.0f, 0.0f), 0.0f, radians(180.0f)};
+  scene.spins.add(cameraEntity, cubeSpin);
+
+  // Simple car going in circles
+  Entity carEntity = scene.createEntity();
+  scene.addTransform(carEntity, vec3(0.0f));
+  OrbitComponent carOrbit = {5.0f, 0.0f, 2.0f};
+  scene.orbits.add(carEntity, carOrbit);
+  RenderableComponent carBody = {cementTextureID, 0, 36};
+  scene.renderables.add(carEntity, carBody);
+
+  // Top part relative to the bottom part of the car
+  Entity carTopEntity = scene.createEntity();
+  scene.addTransform(carTopEntity, vec3(0.0f), vec3(0.5f, 0.25f, 1.0f),
+                     vec3(0.0f, 2.5f, 0.0f), carEntity);
+  RenderableComponent carTop = {brickTextureID, 0, 36};
+  scene.renderables.add(carTopEntity, carTop);
+
+  // 4 simplified cube wheels relative to the main body
+  const float carPosX[4] = {-0.5f, -0.5f, 0.5f, 0.5f};
+  const float carPosZ[4] = {0.5f, -0.5f, 0.5f, -0.5f};
+  for (int i = 0; i < 4; i++) {
+    Entity wheelEntity = scene.createEntity();
+    scene.addTransform(wheelEntity, vec3(0.0f), vec3(0.4f, 0.4f, 0.2f),
+                       vec3(5 * carPosX[i], -0.5f, 5 * carPosZ[i]), carEntity);
+    SpinComponent wheelSpin = {vec3(0.0f, 0.0f, 1.0f), 0.0f,
+                               10 * carOrbit.speed};
+    scene.spins.add(wheelEntity, wheelSpin);
+    RenderableComponent wheel = {brickTextureID, 0, 36};
+    scene.renderables.add(wheelEntity, wheel);
+  }
 
   // Set projection matrix for shader, this won't change
   mat4 projectionMatrix =
@@ -236,9 +658,10 @@ int main(int argc, char *argv[]) {
                        0.01f, 100.0f);  // near and far (near > 0)
 
   // Set initial view matrix
-  mat4 viewMatrix = lookAt(cameraPosition,                // eye
-                           cameraPosition + cameraLookAt, // center
-                           cameraUp);                     // up
+  vec3 cameraPosition = scene.transforms.get(cameraEntity).position;
+  mat4 viewMatrix = lookAt(cameraPosition,                       // eye
+                           cameraPosition + playerCamera.lookAt, // center
+                           playerCamera.up);                     // up
 
   // Set View and Projection matrices on both shaders
   setViewMatrix(colorShaderProgram, viewMatrix);
@@ -248,11 +671,17 @@ int main(int argc, char *argv[]) {
   setProjectionMatrix(texturedShaderProgram, projectionMatrix);
 
   // Define and upload geometry to the GPU here ...
-  int texturedCubeVAO = createTexturedCubeVertexArrayObject();
+  int texturedCubeVAO = createTexturedCubeVertexArrayObject(residency);
+
+  // Voxel ground, streamed in around the camera by background workers
+  VoxelWorld voxelWorld(
+      6, std::max(1, int(std::thread::hardware_concurrency()) - 1),
+      residency);
 
   // For frame time
   float lastFrameTime = glfwGetTime();
   int lastMouseLeftState = GLFW_RELEASE;
+  int lastStatsKeyState = GLFW_RELEASE;
   double lastMousePosX, lastMousePosY;
   glfwGetCursorPos(window, &lastMousePosX, &lastMousePosY);
 
@@ -261,14 +690,9 @@ int main(int argc, char *argv[]) {
   glEnable(GL_CULL_FACE);
   glEnable(GL_DEPTH_TEST);
 
-  // we only draw cubes
+  // we only draw cubes (and voxel chunks, which rebind the cube after)
   glBindVertexArray(texturedCubeVAO);
 
-  // variables
-  float angle = 0.0f;
-  float x, z = 0.0f;
-  float rotationSpeed = 2.0f; // 1 degrees per second
-
   // Entering Main Loop
   while (!glfwWindowShouldClose(window)) {
 
@@ -277,6 +701,20 @@ int main(int argc, char *argv[]) {
     float dt = glfwGetTime() - lastFrameTime;
     lastFrameTime += dt;
 
+    // Update orbits, spins, world matrices and the camera view
+    scheduler.run(scene, dt);
+    TransformComponent &cameraTransform = scene.transforms.get(cameraEntity);
+    CameraComponent &camera = scene.cameras.get(cameraEntity);
+    setViewMatrix(colorShaderProgram, camera.viewMatrix);
+    setViewMatrix(texturedShaderProgram, camera.viewMatrix);
+
+    // Stream voxel chunks in and out around the camera
+    voxelWorld.update(cameraTransform.position);
+    glBindVertexArray(texturedCubeVAO);
+
+    // Finish texture reloads and evict down to the memory budget
+    residency.update();
+
     // Each frame, reset color of each pixel to glClearColor
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glDepthMask(GL_FALSE); // Disable depth writing
@@ -289,22 +727,22 @@ int main(int argc, char *argv[]) {
 
     // Draw each face with the correct texture
     // Left (-X)
-    glBindTexture(GL_TEXTURE_2D, sky_negx);
+    residency.bindTexture(sky_negx);
     glDrawArrays(GL_TRIANGLES, 0, 6);
     // Back (-Z)
-    glBindTexture(GL_TEXTURE_2D, sky_negz);
+    residency.bindTexture(sky_negz);
     glDrawArrays(GL_TRIANGLES, 6, 6);
     // Bottom (-Y)
-    glBindTexture(GL_TEXTURE_2D, sky_negy);
+    residency.bindTexture(sky_negy);
     glDrawArrays(GL_TRIANGLES, 12, 6);
     // Front (+Z)
-    glBindTexture(GL_TEXTURE_2D, sky_posz);
+    residency.bindTexture(sky_posz);
     glDrawArrays(GL_TRIANGLES, 18, 6);
     // Right (+X)
-    glBindTexture(GL_TEXTURE_2D, sky_posx);
+    residency.bindTexture(sky_posx);
     glDrawArrays(GL_TRIANGLES, 24, 6);
     // Top (+Y)
-    glBindTexture(GL_TEXTURE_2D, sky_posy);
+    residency.bindTexture(sky_posy);
     glDrawArrays(GL_TRIANGLES, 30, 6);
 
     glDepthMask(GL_TRUE);
@@ -312,84 +750,41 @@ int main(int argc, char *argv[]) {
     glActiveTexture(GL_TEXTURE0);
     GLuint textureLocation =
         glGetUniformLocation(texturedShaderProgram, "textureSampler");
-    glBindTexture(GL_TEXTURE_2D, brickTextureID);
+    residency.bindTexture(brickTextureID);
     glUniform1i(textureLocation,
                 0); // Set our Texture sampler to user Texture Unit 0
 
-    // rate of rotation
-    angle = (angle + rotationSpeed * dt); // angles in degrees, but glm expects
-                                          // radians (conversion below);
-    // glm::mat4 rotationMatrix = glm::rotate(translationMatrix,
-    // glm::radians(angle)+radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    //  car vector
-    float radius = 5.0f;
-    vec3 carLocation = vec3(radius * cos(angle), 0.0f, radius * sin(angle));
-    mat4 translationMatrix = translate(mat4(1.0f), carLocation);
-
-    glm::mat4 rotationMatrix =
-        glm::rotate(mat4(1.0f), -angle+radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-
-    // Draw simple car to go in circles
-    glBindTexture(GL_TEXTURE_2D, cementTextureID);
-    mat4 carWorldMatrix = translationMatrix * rotationMatrix;
-    setWorldMatrix(texturedShaderProgram, carWorldMatrix);
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-
-    // drawing a top part relative to the bottom part of the car.
-    glBindTexture(GL_TEXTURE_2D, brickTextureID);
-    mat4 carTOPWorldMatrix = carWorldMatrix *
-                             scale(mat4(1.0f), vec3(0.5f, 0.25f, 1.0f)) *
-                             translate(mat4(1.0f), vec3(0.0f, 2.5f, 0.0f));
-    setWorldMatrix(texturedShaderProgram, carTOPWorldMatrix);
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-
-    // set to draw 4 simplified cube wheels now relative to mainbody.
-    //glBindTexture(GL_TEXTURE_2D, wheelTextureID);
-    const float carPosX[4] = {-0.5f,-0.5f,0.5f,0.5f};
-    const float carPosZ[4] = {0.5f,-0.5f,0.5f,-0.5f};
-    for(int i = 0; i < 4; i++) {
-      mat4 carWheelWorldMatrix = carWorldMatrix * 
-                            scale(mat4(1.0f), vec3(0.4f, 0.4f, 0.2f)) *
-                            translate(mat4(1.0f), vec3(5*carPosX[i], -0.5f, 5*carPosZ[i]));
-      rotationMatrix =
-        glm::rotate(mat4(1.0f), 10*angle, glm::vec3(0.0f, 0.0f, 1.0f));
-      carWheelWorldMatrix = carWheelWorldMatrix * rotationMatrix;
-      setWorldMatrix(texturedShaderProgram, carWheelWorldMatrix);
-      glDrawArrays(GL_TRIANGLES, 0, 36);
-    }
+    // Draw voxel ground
+    voxelWorld.draw(texturedShaderProgram, cementTextureID, brickTextureID);
+    glBindVertexArray(texturedCubeVAO);
 
+    // Draw the car parts and any other textured entities
+    drawRenderables(scene, texturedShaderProgram, residency);
 
     // Draw colored geometry
     glUseProgram(colorShaderProgram);
 
     // Spinning cube at camera position
-    spinningCubeAngle += 180.0f * dt;
+    const SpinComponent &avatarSpin = scene.spins.get(cameraEntity);
 
     // Draw avatar in view space for first person camera
     // and in world space for third person camera
-    if (cameraFirstPerson) {
+    if (camera.firstPerson) {
       // Wolrd matrix is identity, but view transform like a world transform
       // relative to camera basis (1 unit in front of camera)
       //
       // This is similar to a weapon moving with camera in a shooter game
       mat4 spinningCubeViewMatrix =
           translate(mat4(1.0f), vec3(0.0f, 0.0f, -1.0f)) *
-          rotate(mat4(1.0f), radians(spinningCubeAngle),
-                 vec3(0.0f, 1.0f, 0.0f)) *
+          rotate(mat4(1.0f), avatarSpin.angle, avatarSpin.axis) *
           scale(mat4(1.0f), vec3(0.01f, 0.01f, 0.01f));
 
       setWorldMatrix(colorShaderProgram, mat4(1.0f));
       setViewMatrix(colorShaderProgram, spinningCubeViewMatrix);
     } else {
       // In third person view, let's draw the spinning cube in world space, like
-      // any other models
-      mat4 spinningCubeWorldMatrix =
-          translate(mat4(1.0f), cameraPosition) *
-          rotate(mat4(1.0f), radians(spinningCubeAngle),
-                 vec3(0.0f, 1.0f, 0.0f)) *
-          scale(mat4(1.0f), vec3(0.1f, 0.1f, 0.1f));
-
-      setWorldMatrix(colorShaderProgram, spinningCubeWorldMatrix);
+      // any other models (the transform system applies its spin and scale)
+      setWorldMatrix(colorShaderProgram, cameraTransform.worldMatrix);
     }
     glDrawArrays(GL_TRIANGLES, 0, 36);
 
@@ -403,19 +798,27 @@ int main(int argc, char *argv[]) {
 
     if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS) // move camera down
     {
-      cameraFirstPerson = true;
+      camera.firstPerson = true;
     }
 
     if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS) // move camera down
     {
-      cameraFirstPerson = false;
+      camera.firstPerson = false;
+    }
+
+    // Print voxel world and GPU memory stats when I is pressed
+    int statsKeyState = glfwGetKey(window, GLFW_KEY_I);
+    if (statsKeyState == GLFW_PRESS && lastStatsKeyState == GLFW_RELEASE) {
+      voxelWorld.printStats(std::cout);
+      residency.printStats(std::cout);
     }
+    lastStatsKeyState = statsKeyState;
 
     // This was solution for Lab02 - Moving camera exercise
     // We'll change this to be a first or third person camera
     bool fastCam = glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS ||
                    glfwGetKey(window, GLFW_KEY_RIGHT_SHIFT) == GLFW_PRESS;
-    float currentCameraSpeed = (fastCam) ? cameraFastSpeed : cameraSpeed;
+    float currentCameraSpeed = (fastCam) ? camera.fastSpeed : camera.speed;
 
     // - Calculate mouse motion dx and dy
     // - Update camera horizontal and vertical angle
@@ -430,19 +833,19 @@ int main(int argc, char *argv[]) {
 
     // Convert to spherical coordinates
     const float cameraAngularSpeed = 60.0f;
-    cameraHorizontalAngle -= dx * cameraAngularSpeed * dt;
-    cameraVerticalAngle -= dy * cameraAngularSpeed * dt;
+    camera.horizontalAngle -= dx * cameraAngularSpeed * dt;
+    camera.verticalAngle -= dy * cameraAngularSpeed * dt;
 
     // Clamp vertical angle to [-85, 85] degrees
-    cameraVerticalAngle =
-        std::max(-85.0f, std::min(85.0f, cameraVerticalAngle));
+    camera.verticalAngle =
+        std::max(-85.0f, std::min(85.0f, camera.verticalAngle));
 
-    float theta = radians(cameraHorizontalAngle);
-    float phi = radians(cameraVerticalAngle);
+    float theta = radians(camera.horizontalAngle);
+    float phi = radians(camera.verticalAngle);
 
-    cameraLookAt =
+    camera.lookAt =
         vec3(cosf(phi) * cosf(theta), sinf(phi), -cosf(phi) * sinf(theta));
-    vec3 cameraSideVector = glm::cross(cameraLookAt, vec3(0.0f, 1.0f, 0.0f));
+    vec3 cameraSideVector = glm::cross(camera.lookAt, vec3(0.0f, 1.0f, 0.0f));
 
     cameraSideVector = glm::normalize(cameraSideVector);
 
@@ -455,42 +858,23 @@ int main(int argc, char *argv[]) {
     }
 
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
-      cameraPosition += cameraLookAt * dt * currentCameraSpeed;
+      cameraTransform.position += camera.lookAt * dt * currentCameraSpeed;
     }
 
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
-      cameraPosition -= cameraLookAt * dt * currentCameraSpeed;
+      cameraTransform.position -= camera.lookAt * dt * currentCameraSpeed;
     }
 
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
-      cameraPosition += cameraSideVector * dt * currentCameraSpeed;
+      cameraTransform.position += cameraSideVector * dt * currentCameraSpeed;
     }
 
     if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
-      cameraPosition -= cameraSideVector * dt * currentCameraSpeed;
-    }
-
-    // Set the view matrix for first and third person cameras
-    // - In first person, camera lookat is set like below
-    // - In third person, camera position is on a sphere looking towards center
-    mat4 viewMatrix(1.0f);
-
-    if (cameraFirstPerson) {
-      viewMatrix =
-          lookAt(cameraPosition, cameraPosition + cameraLookAt, cameraUp);
-    } else {
-      // Position of the camera is on the sphere looking at the point of
-      // interest (cameraPosition)
-      float radius = 5.0f;
-      vec3 position = cameraPosition - vec3(radius * cosf(phi) * cosf(theta),
-                                            radius * sinf(phi),
-                                            -radius * cosf(phi) * sinf(theta));
-      ;
-      viewMatrix = lookAt(position, cameraPosition, cameraUp);
+      cameraTransform.position -= cameraSideVector * dt * currentCameraSpeed;
     }
 
-    setViewMatrix(colorShaderProgram, viewMatrix);
-    setViewMatrix(texturedShaderProgram, viewMatrix);
+    // The camera system turns the new position and angles into the view
+    // matrix at the start of the next frame
 
     // Shoot projectiles on mouse left click
     // To detect onPress events, we need to check the last state and the current
@@ -498,6 +882,8 @@ int main(int argc, char *argv[]) {
     // projectiles on each mouse press
   }
 
+  voxelWorld.shutdown();
+  residency.shutdown();
   glfwTerminate();
 
   return 0;
@@ -567,11 +953,15 @@ const char *getTexturedFragmentShaderSource() {
          "in vec3 vertexColor;"
          "in vec2 vertexUV;"
          "uniform sampler2D textureSampler;"
+         "uniform bool vertexShading = false;" // voxel chunks shade faces
+                                               // with the vertex color
          ""
          "out vec4 FragColor;"
          "void main()"
          "{"
          "   vec4 textureColor = texture(    textureSampler, vertexUV    );"
+         "   if (vertexShading)"
+         "      textureColor.rgb *= vertexColor;"
          "   FragColor = textureColor;"
          "}";
 }
@@ -630,46 +1020,81 @@ int compileAndLinkShaders(const char *vertexShaderSource,
   return shaderProgram;
 }
 
-GLuint loadTexture(const char *filename) {
+static GLenum textureFormat(int nrChannels) {
+  if (nrChannels == 1)
+    return GL_RED;
+  else if (nrChannels == 3)
+    return GL_RGB;
+  else if (nrChannels == 4)
+    return GL_RGBA;
+  return 0;
+}
+
+GLuint GpuResidencyManager::loadTexture(const char *filename) {
   // Step 1 load textures with dimensional data
   int width, height, nrChannels;
   unsigned char *data = stbi_load(filename, &width, &height, &nrChannels, 0);
   if (!data) {
-  std:
-    cerr << "Error::Texture could not load texture files" << filename
-         << std::endl;
+    std::cerr << "Error::Texture could not load texture files" << filename
+              << std::endl;
     return 0;
   }
 
-  // Step 2 Create and bind textures
+  // Step 2 Create textures and record their size
   GLuint textureId = 0;
   glGenTextures(1, &textureId);
   assert(textureId != 0);
 
+  TextureResidency texture;
+  texture.filename = filename;
+  texture.width = width;
+  texture.height = height;
+  texture.channels = nrChannels;
+  texture.levelCount = 1;
+  while ((std::max(width, height) >> texture.levelCount) > 0)
+    ++texture.levelCount;
+  texture.residentLevel = 0;
+  texture.lowestLevel = 0;
+  while (texture.lowestLevel + 1 < texture.levelCount &&
+         (std::max(width, height) >> texture.lowestLevel) > minResidentSize)
+    ++texture.lowestLevel;
+  texture.bytes = bytesFromLevel(texture, 0);
+  texture.lastUsedFrame = frame;
+  texture.reloadRetryFrame = 0;
+  texture.reloadPending = false;
+
+  // Step 3 make room for it, then upload
+  if (getUsage() + texture.bytes > budget)
+    evictUntil(budget - std::min(budget, texture.bytes), textureId, false);
+  uploadTextureImage(textureId, width, height, nrChannels, data);
+  textures[textureId] = texture;
+  textureBytes += texture.bytes;
+
+  // Step 4 Free resources
+  stbi_image_free(data);
+  return textureId;
+}
+
+void uploadTextureImage(GLuint textureId, int width, int height,
+                        int nrChannels, const unsigned char *data) {
   glBindTexture(GL_TEXTURE_2D, textureId);
 
-  // Step 3 set filter parameters
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  // Set filter parameters, mipmapped so textures can be shrunk on eviction
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  // Step 4 Upload textures to fv
-  GLenum format = 0;
-  if (nrChannels == 1)
-    format = GL_RED;
-  else if (nrChannels == 3)
-    format = GL_RGB;
-  else if (nrChannels == 4)
-    format = GL_RGBA;
+  // Upload textures, rows are tightly packed (RGB rows may not be 4-aligned)
+  GLenum format = textureFormat(nrChannels);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
   glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
                GL_UNSIGNED_BYTE, data);
+  glGenerateMipmap(GL_TEXTURE_2D);
 
-  // Step 5 Free resources
-  stbi_image_free(data);
-  glBindTexture(GL_TEXTURE, 0);
-  return textureId;
-};
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-int createTexturedCubeVertexArrayObject() {
+int createTexturedCubeVertexArrayObject(GpuResidencyManager &residency) {
   // Create a vertex array
   GLuint vertexArrayObject;
   glGenVertexArrays(1, &vertexArrayObject);
@@ -682,6 +1107,7 @@ int createTexturedCubeVertexArrayObject() {
   glBindBuffer(GL_ARRAY_BUFFER, vertexBufferObject);
   glBufferData(GL_ARRAY_BUFFER, sizeof(texturedCubeVertexArray),
                texturedCubeVertexArray, GL_STATIC_DRAW);
+  residency.trackBuffer(vertexBufferObject, sizeof(texturedCubeVertexArray));
 
   glVertexAttribPointer(
       0,        // attribute 0 matches aPos in Vertex Shader
@@ -712,3 +1138,981 @@ int createTexturedCubeVertexArrayObject() {
   return vertexArrayObject;
 }
 
+
+unsigned char generateVoxel(int worldX, int worldY, int worldZ) {
+  // Solid below the chunks so the bottom of the world is never meshed
+  if (worldY < 0)
+    return VOXEL_CEMENT;
+  if (worldY >= CHUNK_HEIGHT)
+    return VOXEL_AIR;
+
+  // Flat cement ground around the car track, brick hills further out
+  int height = VOXEL_GROUND_LEVEL;
+  float distance = sqrtf(float(worldX * worldX + worldZ * worldZ));
+  if (distance > 12.0f) {
+    float falloff = std::min(1.0f, (distance - 12.0f) / 8.0f);
+    float hills = sinf(worldX * 0.15f) + cosf(worldZ * 0.11f) +
+                  0.5f * sinf((worldX + worldZ) * 0.05f);
+    height += std::max(0, int(hills * 3.0f * falloff));
+    height = std::min(height, CHUNK_HEIGHT);
+  }
+
+  if (worldY >= height)
+    return VOXEL_AIR;
+  return worldY >= VOXEL_GROUND_LEVEL ? VOXEL_BRICK : VOXEL_CEMENT;
+}
+
+void greedyMeshChunk(int chunkX, int chunkZ,
+                     const std::vector<unsigned char> &paddedVoxels,
+                     VoxelChunkBuild &build, long long &quadCount) {
+  // paddedVoxels has a one voxel border taken from the neighbour chunks, so
+  // faces on chunk boundaries are culled without touching other chunks
+  const int rowSize = CHUNK_SIZE + 2;
+  auto voxelAt = [&](const int p[3]) {
+    return paddedVoxels[((p[1] + 1) * rowSize + (p[2] + 1)) * rowSize +
+                        (p[0] + 1)];
+  };
+
+  const int dims[3] = {CHUNK_SIZE, CHUNK_HEIGHT, CHUNK_SIZE};
+  const int worldOffset[3] = {chunkX * CHUNK_SIZE, 0, chunkZ * CHUNK_SIZE};
+
+  std::vector<TexturedColoredVertex> cementVertices;
+  std::vector<TexturedColoredVertex> brickVertices;
+  std::vector<int> mask;
+
+  // Sweep a plane along each axis, build a mask of visible faces (signed
+  // material, positive faces point along +d) and merge it into rectangles
+  for (int d = 0; d < 3; ++d) {
+    int u = (d + 1) % 3;
+    int v = (d + 2) % 3;
+    int x[3] = {0, 0, 0};
+    int q[3] = {0, 0, 0};
+    q[d] = 1;
+    mask.assign(dims[u] * dims[v], 0);
+
+    for (x[d] = -1; x[d] < dims[d];) {
+      int n = 0;
+      for (x[v] = 0; x[v] < dims[v]; ++x[v]) {
+        for (x[u] = 0; x[u] < dims[u]; ++x[u]) {
+          int next[3] = {x[0] + q[0], x[1] + q[1], x[2] + q[2]};
+          unsigned char a = voxelAt(x);
+          unsigned char b = voxelAt(next);
+          int face = 0;
+          // Only keep faces of voxels inside this chunk
+          if (a != VOXEL_AIR && b == VOXEL_AIR && x[d] >= 0)
+            face = a;
+          else if (a == VOXEL_AIR && b != VOXEL_AIR && x[d] < dims[d] - 1)
+            face = -b;
+          mask[n++] = face;
+        }
+      }
+      ++x[d];
+
+      n = 0;
+      for (int j = 0; j < dims[v]; ++j) {
+        for (int i = 0; i < dims[u];) {
+          int face = mask[n];
+          if (face == 0) {
+            ++i;
+            ++n;
+            continue;
+          }
+
+          // Grow the quad along u, then along v while whole rows match
+          int w = 1;
+          while (i + w < dims[u] && mask[n + w] == face)
+            ++w;
+          int h = 1;
+          for (; j + h < dims[v]; ++h) {
+            bool rowMatches = true;
+            for (int k = 0; k < w; ++k) {
+              if (mask[n + k + h * dims[u]] != face) {
+                rowMatches = false;
+                break;
+              }
+            }
+            if (!rowMatches)
+              break;
+          }
+
+          int corners[4][3];
+          for (int c = 0; c < 4; ++c) {
+            corners[c][d] = x[d];
+            corners[c][u] = i + ((c == 1 || c == 2) ? w : 0);
+            corners[c][v] = j + ((c == 2 || c == 3) ? h : 0);
+          }
+
+          // Faces are shaded with the vertex color (see vertexShading in the
+          // textured shader), uvs come from world coordinates so textures
+          // tile once per voxel across chunks
+          vec3 color = (d == 1) ? vec3(face > 0 ? 1.0f : 0.5f) : vec3(0.8f);
+          TexturedColoredVertex quad[4] = {
+              TexturedColoredVertex(vec3(0.0f), color, vec2(0.0f)),
+              TexturedColoredVertex(vec3(0.0f), color, vec2(0.0f)),
+              TexturedColoredVertex(vec3(0.0f), color, vec2(0.0f)),
+              TexturedColoredVertex(vec3(0.0f), color, vec2(0.0f))};
+          for (int c = 0; c < 4; ++c) {
+            float wx = float(corners[c][0] + worldOffset[0]);
+            float wy = float(corners[c][1] + worldOffset[1]);
+            float wz = float(corners[c][2] + worldOffset[2]);
+            quad[c].position = vec3(wx, wy + VOXEL_WORLD_BASE_Y, wz);
+            if (d == 0)
+              quad[c].uv = vec2(wz, wy);
+            else if (d == 1)
+              quad[c].uv = vec2(wx, wz);
+            else
+              quad[c].uv = vec2(wx, wy);
+          }
+
+          // Counter clockwise when seen from the side the face points to
+          std::vector<TexturedColoredVertex> &out =
+              (std::abs(face) == VOXEL_BRICK) ? brickVertices : cementVertices;
+          const int positiveOrder[6] = {0, 1, 2, 0, 2, 3};
+          const int negativeOrder[6] = {0, 2, 1, 0, 3, 2};
+          const int *order = (face > 0) ? positiveOrder : negativeOrder;
+          for (int k = 0; k < 6; ++k)
+            out.push_back(quad[order[k]]);
+          ++quadCount;
+
+          for (int l = 0; l < h; ++l)
+            for (int k = 0; k < w; ++k)
+              mask[n + k + l * dims[u]] = 0;
+          i += w;
+          n += w;
+        }
+      }
+    }
+  }
+
+  build.cementVertexCount = int(cementVertices.size());
+  build.brickVertexCount = int(brickVertices.size());
+  build.vertices.swap(cementVertices);
+  build.vertices.insert(build.vertices.end(), brickVertices.begin(),
+                        brickVertices.end());
+}
+
+VoxelWorld::VoxelWorld(int loadRadius, int workerCount,
+                       GpuResidencyManager &residency)
+    : loadRadius(loadRadius), centerChunk(0, 0), residency(residency),
+      startTime(std::chrono::steady_clock::now()) {
+  for (int i = 0; i < std::max(1, workerCount); ++i)
+    workers.push_back(std::thread(&VoxelWorld::workerLoop, this));
+}
+
+VoxelWorld::~VoxelWorld() {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    stopping = true;
+  }
+  queueCondition.notify_all();
+  for (std::thread &worker : workers)
+    if (worker.joinable())
+      worker.join();
+}
+
+void VoxelWorld::workerLoop() {
+  // Voxels only live on the worker while the chunk is meshed, the buffer is
+  // reused for every chunk this worker builds
+  const int rowSize = CHUNK_SIZE + 2;
+  std::vector<unsigned char> voxels(rowSize * rowSize * (CHUNK_HEIGHT + 2));
+
+  while (true) {
+    ChunkCoord coord;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueCondition.wait(
+          lock, [this] { return stopping || !pendingChunks.empty(); });
+      if (stopping)
+        return;
+      coord = pendingChunks.front();
+      pendingChunks.pop_front();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    VoxelChunkBuild build;
+    build.chunkX = coord.first;
+    build.chunkZ = coord.second;
+    int baseX = coord.first * CHUNK_SIZE;
+    int baseZ = coord.second * CHUNK_SIZE;
+    size_t index = 0;
+    for (int y = -1; y <= CHUNK_HEIGHT; ++y)
+      for (int z = -1; z <= CHUNK_SIZE; ++z)
+        for (int x = -1; x <= CHUNK_SIZE; ++x)
+          voxels[index++] = generateVoxel(baseX + x, y, baseZ + z);
+
+    long long quadCount = 0;
+    greedyMeshChunk(coord.first, coord.second, voxels, build, quadCount);
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    meshingNanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    quadsMeshed += quadCount;
+    ++chunksMeshed;
+
+    std::lock_guard<std::mutex> lock(queueMutex);
+    finishedChunks.push_back(std::move(build));
+  }
+}
+
+void VoxelWorld::update(vec3 cameraPosition) {
+  centerChunk = ChunkCoord(int(floorf(cameraPosition.x / CHUNK_SIZE)),
+                           int(floorf(cameraPosition.z / CHUNK_SIZE)));
+  auto distance2 = [this](const ChunkCoord &c) {
+    int dx = c.first - centerChunk.first;
+    int dz = c.second - centerChunk.second;
+    return dx * dx + dz * dz;
+  };
+  // Chunks are kept one ring past loadRadius so they don't thrash on borders
+  const int loadRadius2 = loadRadius * loadRadius;
+  const int evictRadius2 = (loadRadius + 1) * (loadRadius + 1);
+
+  std::vector<VoxelChunkBuild> uploads;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+
+    // Cancel queued chunks the camera moved away from
+    std::deque<ChunkCoord> stillWanted;
+    for (const ChunkCoord &coord : pendingChunks) {
+      if (distance2(coord) <= evictRadius2)
+        stillWanted.push_back(coord);
+      else
+        requestedChunks.erase(coord);
+    }
+    pendingChunks.swap(stillWanted);
+
+    // Request missing chunks, closest first
+    for (int dz = -loadRadius; dz <= loadRadius; ++dz) {
+      for (int dx = -loadRadius; dx <= loadRadius; ++dx) {
+        ChunkCoord coord(centerChunk.first + dx, centerChunk.second + dz);
+        if (dx * dx + dz * dz > loadRadius2 || residentChunks.count(coord) ||
+            requestedChunks.count(coord))
+          continue;
+        requestedChunks.insert(coord);
+        pendingChunks.push_back(coord);
+      }
+    }
+    std::sort(pendingChunks.begin(), pendingChunks.end(),
+              [&](const ChunkCoord &a, const ChunkCoord &b) {
+                return distance2(a) < distance2(b);
+              });
+
+    // Take finished meshes within this frame's upload budget
+    size_t uploadBytes = 0;
+    while (!finishedChunks.empty() &&
+           int(uploads.size()) < maxUploadsPerFrame &&
+           (uploads.empty() || uploadBytes < maxUploadBytesPerFrame)) {
+      uploadBytes += finishedChunks.front().vertices.size() *
+                     sizeof(TexturedColoredVertex);
+      uploads.push_back(std::move(finishedChunks.front()));
+      finishedChunks.pop_front();
+    }
+  }
+  queueCondition.notify_all();
+
+  for (auto it = residentChunks.begin(); it != residentChunks.end();) {
+    if (distance2(it->first) > evictRadius2) {
+      deleteChunk(it->second);
+      it = residentChunks.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (VoxelChunkBuild &build : uploads) {
+    ChunkCoord coord(build.chunkX, build.chunkZ);
+    requestedChunks.erase(coord);
+    if (distance2(coord) > evictRadius2)
+      continue; // camera moved away while it was being meshed
+    uploadChunk(build);
+  }
+}
+
+void VoxelWorld::uploadChunk(VoxelChunkBuild &build) {
+  VoxelChunk chunk;
+  chunk.cementVertexCount = build.cementVertexCount;
+  chunk.brickVertexCount = build.brickVertexCount;
+  chunk.vertexArrayObject = 0;
+  chunk.vertexBufferObject = 0;
+
+  if (!build.vertices.empty()) {
+    glGenVertexArrays(1, &chunk.vertexArrayObject);
+    glBindVertexArray(chunk.vertexArrayObject);
+
+    glGenBuffers(1, &chunk.vertexBufferObject);
+    glBindBuffer(GL_ARRAY_BUFFER, chunk.vertexBufferObject);
+    glBufferData(GL_ARRAY_BUFFER,
+                 build.vertices.size() * sizeof(TexturedColoredVertex),
+                 &build.vertices[0], GL_STATIC_DRAW);
+    residency.trackBuffer(chunk.vertexBufferObject,
+                          build.vertices.size() * sizeof(TexturedColoredVertex));
+
+    // Same layout as the textured cube (position, color, uv)
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
+                          sizeof(TexturedColoredVertex), (void *)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
+                          sizeof(TexturedColoredVertex), (void *)sizeof(vec3));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE,
+                          sizeof(TexturedColoredVertex),
+                          (void *)(2 * sizeof(vec3)));
+    glEnableVertexAttribArray(2);
+  }
+
+  residentVertexBytes += build.vertices.size() * sizeof(TexturedColoredVertex);
+  residentChunks[ChunkCoord(build.chunkX, build.chunkZ)] = std::move(chunk);
+}
+
+void VoxelWorld::deleteChunk(VoxelChunk &chunk) {
+  residentVertexBytes -= (chunk.cementVertexCount + chunk.brickVertexCount) *
+                         sizeof(TexturedColoredVertex);
+  if (chunk.vertexBufferObject != 0) {
+    residency.untrackBuffer(chunk.vertexBufferObject);
+    glDeleteBuffers(1, &chunk.vertexBufferObject);
+  }
+  if (chunk.vertexArrayObject != 0)
+    glDeleteVertexArrays(1, &chunk.vertexArrayObject);
+  chunk.vertexBufferObject = 0;
+  chunk.vertexArrayObject = 0;
+}
+
+void VoxelWorld::draw(int shaderProgram, GLuint cementTextureID,
+                      GLuint brickTextureID) {
+  // Chunk vertices are already in world space, and unlike the cube model
+  // their vertex colors are face shading
+  setWorldMatrix(shaderProgram, mat4(1.0f));
+  GLuint vertexShadingLocation =
+      glGetUniformLocation(shaderProgram, "vertexShading");
+  glUniform1i(vertexShadingLocation, 1);
+
+  // One pass per material so each texture is bound once
+  residency.bindTexture(cementTextureID);
+  for (auto &entry : residentChunks) {
+    const VoxelChunk &chunk = entry.second;
+    if (chunk.cementVertexCount == 0)
+      continue;
+    glBindVertexArray(chunk.vertexArrayObject);
+    glDrawArrays(GL_TRIANGLES, 0, chunk.cementVertexCount);
+  }
+
+  residency.bindTexture(brickTextureID);
+  for (auto &entry : residentChunks) {
+    const VoxelChunk &chunk = entry.second;
+    if (chunk.brickVertexCount == 0)
+      continue;
+    glBindVertexArray(chunk.vertexArrayObject);
+    glDrawArrays(GL_TRIANGLES, chunk.cementVertexCount,
+                 chunk.brickVertexCount);
+  }
+
+  glUniform1i(vertexShadingLocation, 0);
+}
+
+void VoxelWorld::printStats(std::ostream &out) {
+  size_t pending;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    pending = pendingChunks.size() + finishedChunks.size();
+  }
+
+  long long chunks = chunksMeshed;
+  double meshingSeconds = meshingNanoseconds * 1e-9;
+  double elapsedSeconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - startTime)
+                              .count();
+  double voxelsPerChunk = double(CHUNK_SIZE) * CHUNK_SIZE * CHUNK_HEIGHT;
+
+  out << "Voxel world: " << residentChunks.size() << " resident chunks, "
+      << pending << " pending, " << workers.size() << " workers" << std::endl;
+  out << "  meshed " << chunks << " chunks, " << quadsMeshed << " quads";
+  if (chunks > 0 && meshingSeconds > 0.0) {
+    out << ", " << meshingSeconds * 1000.0 / chunks << " ms/chunk, "
+        << chunks * voxelsPerChunk / meshingSeconds / 1e6
+        << " Mvoxels/s per worker, " << chunks / elapsedSeconds
+        << " chunks/s wall";
+  }
+  out << std::endl;
+  out << "  resident memory: " << residentVertexBytes / 1024
+      << " KB vertices (GPU)" << std::endl;
+}
+
+void VoxelWorld::shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    stopping = true;
+  }
+  queueCondition.notify_all();
+  for (std::thread &worker : workers)
+    if (worker.joinable())
+      worker.join();
+
+  for (auto &entry : residentChunks)
+    deleteChunk(entry.second);
+  residentChunks.clear();
+}
+
+GpuResidencyManager::GpuResidencyManager(size_t budgetBytes)
+    : budget(budgetBytes), loader(&GpuResidencyManager::loaderLoop, this) {}
+
+GpuResidencyManager::~GpuResidencyManager() { stopLoader(); }
+
+void GpuResidencyManager::stopLoader() {
+  {
+    std::lock_guard<std::mutex> lock(loaderMutex);
+    stopping = true;
+  }
+  loaderCondition.notify_all();
+  if (loader.joinable())
+    loader.join();
+
+  for (TextureImage &image : reloadedImages)
+    stbi_image_free(image.data);
+  reloadedImages.clear();
+}
+
+size_t GpuResidencyManager::bytesFromLevel(const TextureResidency &texture,
+                                           int level) const {
+  // Drivers store RGB textures padded to 4 bytes per texel
+  size_t bytesPerTexel = (texture.channels == 1) ? 1 : 4;
+  size_t bytes = 0;
+  for (int l = level; l < texture.levelCount; ++l)
+    bytes += size_t(std::max(1, texture.width >> l)) *
+             std::max(1, texture.height >> l) * bytesPerTexel;
+  return bytes;
+}
+
+void GpuResidencyManager::loaderLoop() {
+  while (true) {
+    std::pair<GLuint, std::string> request;
+    {
+      std::unique_lock<std::mutex> lock(loaderMutex);
+      loaderCondition.wait(
+          lock, [this] { return stopping || !reloadRequests.empty(); });
+      if (stopping)
+        return;
+      request = reloadRequests.front();
+      reloadRequests.pop_front();
+    }
+
+    TextureImage image;
+    image.textureId = request.first;
+    image.data = stbi_load(request.second.c_str(), &image.width,
+                           &image.height, &image.channels, 0);
+
+    std::lock_guard<std::mutex> lock(loaderMutex);
+    reloadedImages.push_back(image);
+  }
+}
+
+void GpuResidencyManager::bindTexture(GLuint textureId) {
+  glBindTexture(GL_TEXTURE_2D, textureId);
+
+  auto it = textures.find(textureId);
+  if (it == textures.end())
+    return;
+
+  TextureResidency &texture = it->second;
+  texture.lastUsedFrame = frame;
+  if (texture.residentLevel > 0 && !texture.reloadPending &&
+      frame >= texture.reloadRetryFrame) {
+    // Don't decode the file again when the full image can't fit anyway, the
+    // check is cheap so it runs again next frame
+    if (!reloadCanFit(textureId, texture))
+      return;
+    texture.reloadPending = true;
+    {
+      std::lock_guard<std::mutex> lock(loaderMutex);
+      reloadRequests.push_back(std::make_pair(textureId, texture.filename));
+    }
+    loaderCondition.notify_one();
+  }
+}
+
+void GpuResidencyManager::shrinkTexture(GLuint textureId,
+                                        TextureResidency &texture, int level) {
+  // Read the smaller mip back and make it the new base level, the texture
+  // keeps its id so callers holding it don't notice
+  int width = std::max(1, texture.width >> level);
+  int height = std::max(1, texture.height >> level);
+  std::vector<unsigned char> pixels(size_t(width) * height * texture.channels);
+
+  glBindTexture(GL_TEXTURE_2D, textureId);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glGetTexImage(GL_TEXTURE_2D, level - texture.residentLevel,
+                textureFormat(texture.channels), GL_UNSIGNED_BYTE, &pixels[0]);
+  uploadTextureImage(textureId, width, height, texture.channels, &pixels[0]);
+
+  textureBytes -= texture.bytes;
+  texture.residentLevel = level;
+  texture.bytes = bytesFromLevel(texture, level);
+  textureBytes += texture.bytes;
+}
+
+bool GpuResidencyManager::evictUntil(size_t targetUsage, GLuint keepTextureId,
+                                     bool staleOnly) {
+  while (getUsage() > targetUsage) {
+    if (evictionsThisFrame >= maxEvictionsPerFrame)
+      return false;
+
+    // Least recently used texture that can still shrink; stale textures are
+    // the ones not used during the last frame
+    auto victim = textures.end();
+    for (auto it = textures.begin(); it != textures.end(); ++it) {
+      const TextureResidency &texture = it->second;
+      if (it->first == keepTextureId ||
+          texture.residentLevel >= texture.lowestLevel ||
+          (staleOnly && texture.lastUsedFrame + 1 >= frame))
+        continue;
+      if (victim == textures.end() ||
+          texture.lastUsedFrame < victim->second.lastUsedFrame)
+        victim = it;
+    }
+    if (victim == textures.end())
+      return false;
+
+    TextureResidency &texture = victim->second;
+    shrinkTexture(victim->first, texture,
+                  std::min(texture.residentLevel + evictionMipStep,
+                           texture.lowestLevel));
+    ++evictionCount;
+    ++evictionsThisFrame;
+  }
+  return true;
+}
+
+bool GpuResidencyManager::reloadCanFit(
+    GLuint textureId, const TextureResidency &texture) const {
+  size_t fullBytes = bytesFromLevel(texture, 0);
+  if (budget + texture.bytes < fullBytes)
+    return false;
+
+  // Room that evictUntil(..., true) could free by shrinking stale textures
+  size_t reclaimableBytes = 0;
+  for (auto &entry : textures) {
+    const TextureResidency &other = entry.second;
+    if (entry.first == textureId || other.lastUsedFrame + 1 >= frame ||
+        other.residentLevel >= other.lowestLevel)
+      continue;
+    reclaimableBytes += other.bytes - bytesFromLevel(other, other.lowestLevel);
+  }
+  return getUsage() <= budget + texture.bytes - fullBytes + reclaimableBytes;
+}
+
+void GpuResidencyManager::update() {
+  ++frame;
+  evictionsThisFrame = 0;
+
+  std::vector<TextureImage> images;
+  {
+    std::lock_guard<std::mutex> lock(loaderMutex);
+    while (!reloadedImages.empty() &&
+           int(images.size()) < maxReloadsPerFrame) {
+      images.push_back(reloadedImages.front());
+      reloadedImages.pop_front();
+    }
+  }
+
+  std::vector<TextureImage> deferredImages;
+  for (TextureImage &image : images) {
+    auto it = textures.find(image.textureId);
+    if (it == textures.end()) {
+      stbi_image_free(image.data);
+      continue;
+    }
+
+    TextureResidency &texture = it->second;
+    texture.reloadPending = false;
+
+    // Only bring the full image back if stale textures can make room for it,
+    // otherwise the working set is over budget and it stays shrunk for now
+    size_t fullBytes = bytesFromLevel(texture, 0);
+    bool canFit = image.data != NULL && reloadCanFit(image.textureId, texture);
+    bool fits = canFit && evictUntil(budget + texture.bytes - fullBytes,
+                                     image.textureId, true);
+    if (fits) {
+      uploadTextureImage(image.textureId, image.width, image.height,
+                         image.channels, image.data);
+      textureBytes += fullBytes - texture.bytes;
+      texture.bytes = fullBytes;
+      texture.residentLevel = 0;
+      ++reloadCount;
+    } else if (canFit && evictionsThisFrame >= maxEvictionsPerFrame) {
+      // Ran out of evictions this frame, keep the image for the next one
+      texture.reloadPending = true;
+      deferredImages.push_back(image);
+      continue;
+    } else {
+      texture.reloadRetryFrame = frame + reloadRetryFrames;
+    }
+    stbi_image_free(image.data);
+  }
+
+  if (!deferredImages.empty()) {
+    std::lock_guard<std::mutex> lock(loaderMutex);
+    reloadedImages.insert(reloadedImages.begin(), deferredImages.begin(),
+                          deferredImages.end());
+  }
+
+  // Shrink stale textures first, then anything still over budget
+  if (getUsage() > budget && !evictUntil(budget, 0, true))
+    evictUntil(budget, 0, false);
+}
+
+void GpuResidencyManager::trackBuffer(GLuint bufferId, size_t bytes) {
+  untrackBuffer(bufferId);
+  buffers[bufferId] = bytes;
+  bufferBytes += bytes;
+}
+
+void GpuResidencyManager::untrackBuffer(GLuint bufferId) {
+  auto it = buffers.find(bufferId);
+  if (it == buffers.end())
+    return;
+  bufferBytes -= it->second;
+  buffers.erase(it);
+}
+
+void GpuResidencyManager::printStats(std::ostream &out) {
+  int shrunk = 0;
+  for (auto &entry : textures)
+    if (entry.second.residentLevel > 0)
+      ++shrunk;
+
+  const double MB = 1024.0 * 1024.0;
+  out << "GPU memory: " << getUsage() / MB << " / " << budget / MB
+      << " MB (textures " << textureBytes / MB << " MB, buffers "
+      << bufferBytes / MB << " MB)" << std::endl;
+  out << "  " << textures.size() << " textures (" << shrunk << " shrunk), "
+      << buffers.size() << " buffers, " << evictionCount << " evictions, "
+      << reloadCount << " reloads" << std::endl;
+}
+
+void GpuResidencyManager::shutdown() {
+  stopLoader();
+
+  for (auto &entry : textures)
+    glDeleteTextures(1, &entry.first);
+  textures.clear();
+  textureBytes = 0;
+}
+
+Entity Scene::createEntity() {
+  Entity entity;
+  if (!freeEntities.empty()) {
+    entity = freeEntities.back();
+    freeEntities.pop_back();
+  } else {
+    entity = nextEntity++;
+    aliveEntities.resize(nextEntity, false);
+  }
+  aliveEntities[entity] = true;
+  return entity;
+}
+
+void Scene::destroyEntity(Entity entity) {
+  if (!isAlive(entity))
+    return;
+  aliveEntities[entity] = false;
+
+  // Children would be left pointing at a dead parent, take them down too
+  std::vector<Entity> children;
+  for (size_t i = 0; i < transforms.size(); ++i)
+    if (transforms.componentAt(i).parent == entity)
+      children.push_back(transforms.entityAt(i));
+  for (Entity child : children)
+    destroyEntity(child);
+
+  transforms.remove(entity);
+  orbits.remove(entity);
+  spins.remove(entity);
+  renderables.remove(entity);
+  cameras.remove(entity);
+  freeEntities.push_back(entity);
+}
+
+TransformComponent &Scene::addTransform(Entity entity, vec3 position,
+                                        vec3 scale, vec3 offset,
+                                        Entity parent) {
+  TransformComponent transform;
+  transform.position = position;
+  transform.rotationY = 0.0f;
+  transform.scale = scale;
+  transform.offset = offset;
+  transform.parent = parent;
+  transform.depth =
+      (parent != INVALID_ENTITY) ? transforms.get(parent).depth + 1 : 0;
+  transform.worldMatrix = mat4(1.0f);
+  return transforms.add(entity, transform);
+}
+
+SystemScheduler::SystemScheduler(int workerCount) {
+  for (int i = 0; i < workerCount; ++i)
+    workers.push_back(std::thread(&SystemScheduler::workerLoop, this));
+}
+
+SystemScheduler::~SystemScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(taskMutex);
+    stopping = true;
+  }
+  taskCondition.notify_all();
+  for (std::thread &worker : workers)
+    if (worker.joinable())
+      worker.join();
+}
+
+void SystemScheduler::addSystem(const char *name, unsigned int reads,
+                                unsigned int writes,
+                                std::function<void(Scene &, float)> update) {
+  System system;
+  system.name = name;
+  system.reads = reads;
+  system.writes = writes;
+  system.update = update;
+  system.lastRunMilliseconds = 0.0;
+
+  // Run right after the last earlier system it conflicts with: one of the
+  // two writes a component type the other reads or writes
+  system.batch = 0;
+  for (const System &other : systems) {
+    bool conflict = (system.writes & (other.reads | other.writes)) ||
+                    (other.writes & system.reads);
+    if (conflict)
+      system.batch = std::max(system.batch, other.batch + 1);
+  }
+  batchCount = std::max(batchCount, system.batch + 1);
+  systems.push_back(system);
+}
+
+void SystemScheduler::workerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(taskMutex);
+      taskCondition.wait(lock, [this] { return stopping || !tasks.empty(); });
+      if (stopping)
+        return;
+      task = tasks.front();
+      tasks.pop_front();
+    }
+
+    task();
+
+    std::lock_guard<std::mutex> lock(taskMutex);
+    if (--tasksRemaining == 0)
+      doneCondition.notify_all();
+  }
+}
+
+void SystemScheduler::runSystem(System &system, Scene &scene, float dt) {
+  auto start = std::chrono::steady_clock::now();
+  system.update(scene, dt);
+  system.lastRunMilliseconds =
+      std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start)
+          .count();
+}
+
+void SystemScheduler::run(Scene &scene, float dt) {
+  for (int batch = 0; batch < batchCount; ++batch) {
+    std::vector<System *> batchSystems;
+    for (System &system : systems)
+      if (system.batch == batch)
+        batchSystems.push_back(&system);
+
+    // Hand all but one system to the workers, run that one here
+    if (!workers.empty() && batchSystems.size() > 1) {
+      {
+        std::lock_guard<std::mutex> lock(taskMutex);
+        for (size_t i = 1; i < batchSystems.size(); ++i) {
+          System *system = batchSystems[i];
+          tasks.push_back([this, system, &scene, dt] {
+            runSystem(*system, scene, dt);
+          });
+          ++tasksRemaining;
+        }
+      }
+      taskCondition.notify_all();
+      runSystem(*batchSystems[0], scene, dt);
+
+      std::unique_lock<std::mutex> lock(taskMutex);
+      doneCondition.wait(lock, [this] { return tasksRemaining == 0; });
+    } else {
+      for (System *system : batchSystems)
+        runSystem(*system, scene, dt);
+    }
+  }
+}
+
+void SystemScheduler::printStats(std::ostream &out) {
+  for (const System &system : systems)
+    out << "  " << system.name << ": batch " << system.batch << ", "
+        << system.lastRunMilliseconds << " ms" << std::endl;
+}
+
+void addSceneSystems(SystemScheduler &scheduler) {
+  scheduler.addSystem(
+      "orbit", COMPONENT_ORBIT, COMPONENT_ORBIT | COMPONENT_TRANSFORM,
+      [](Scene &scene, float dt) {
+        for (size_t i = 0; i < scene.orbits.size(); ++i) {
+          OrbitComponent &orbit = scene.orbits.componentAt(i);
+          orbit.angle += orbit.speed * dt;
+
+          TransformComponent &transform =
+              scene.transforms.get(scene.orbits.entityAt(i));
+          transform.position =
+              vec3(orbit.radius * cosf(orbit.angle), transform.position.y,
+                   orbit.radius * sinf(orbit.angle));
+          transform.rotationY = -orbit.angle + radians(90.0f);
+        }
+      });
+
+  scheduler.addSystem("spin", COMPONENT_SPIN, COMPONENT_SPIN,
+                      [](Scene &scene, float dt) {
+                        for (size_t i = 0; i < scene.spins.size(); ++i) {
+                          SpinComponent &spin = scene.spins.componentAt(i);
+                          spin.angle += spin.speed * dt;
+                        }
+                      });
+
+  scheduler.addSystem(
+      "transform", COMPONENT_TRANSFORM | COMPONENT_SPIN, COMPONENT_TRANSFORM,
+      [](Scene &scene, float) {
+        // One pass per hierarchy level so parents are done before children
+        int maxDepth = 0;
+        for (int depth = 0; depth <= maxDepth; ++depth) {
+          for (size_t i = 0; i < scene.transforms.size(); ++i) {
+            TransformComponent &transform = scene.transforms.componentAt(i);
+            maxDepth = std::max(maxDepth, transform.depth);
+            if (transform.depth != depth)
+              continue;
+
+            // translate * rotateY * scale * translate(offset), written out
+            // instead of three full matrix products per entity
+            float c = cosf(transform.rotationY);
+            float s = sinf(transform.rotationY);
+            vec3 size = transform.scale;
+            vec3 offset = vec3(size.x * transform.offset.x,
+                               size.y * transform.offset.y,
+                               size.z * transform.offset.z);
+            mat4 worldMatrix(1.0f);
+            worldMatrix[0] = vec4(c * size.x, 0.0f, -s * size.x, 0.0f);
+            worldMatrix[1] = vec4(0.0f, size.y, 0.0f, 0.0f);
+            worldMatrix[2] = vec4(s * size.z, 0.0f, c * size.z, 0.0f);
+            worldMatrix[3] =
+                vec4(c * offset.x + s * offset.z + transform.position.x,
+                     offset.y + transform.position.y,
+                     -s * offset.x + c * offset.z + transform.position.z,
+                     1.0f);
+            if (transform.parent != INVALID_ENTITY)
+              worldMatrix =
+                  scene.transforms.get(transform.parent).worldMatrix *
+                  worldMatrix;
+
+            Entity entity = scene.transforms.entityAt(i);
+            if (scene.spins.has(entity)) {
+              const SpinComponent &spin = scene.spins.get(entity);
+              worldMatrix = worldMatrix * rotate(mat4(1.0f), spin.angle,
+                                                 spin.axis);
+            }
+            transform.worldMatrix = worldMatrix;
+          }
+        }
+      });
+
+  scheduler.addSystem(
+      "camera", COMPONENT_TRANSFORM | COMPONENT_CAMERA, COMPONENT_CAMERA,
+      [](Scene &scene, float) {
+        for (size_t i = 0; i < scene.cameras.size(); ++i) {
+          CameraComponent &camera = scene.cameras.componentAt(i);
+          vec3 position =
+              scene.transforms.get(scene.cameras.entityAt(i)).position;
+
+          // - In first person, camera lookat is set from the mouse angles
+          // - In third person, camera position is on a sphere looking
+          //   towards the point of interest (position)
+          if (camera.firstPerson) {
+            camera.viewMatrix =
+                lookAt(position, position + camera.lookAt, camera.up);
+          } else {
+            float theta = radians(camera.horizontalAngle);
+            float phi = radians(camera.verticalAngle);
+            float radius = 5.0f;
+            vec3 eye = position - vec3(radius * cosf(phi) * cosf(theta),
+                                       radius * sinf(phi),
+                                       -radius * cosf(phi) * sinf(theta));
+            camera.viewMatrix = lookAt(eye, position, camera.up);
+          }
+        }
+      });
+}
+
+void drawRenderables(Scene &scene, int shaderProgram,
+                     GpuResidencyManager &residency) {
+  for (size_t i = 0; i < scene.renderables.size(); ++i) {
+    const RenderableComponent &renderable = scene.renderables.componentAt(i);
+    const TransformComponent &transform =
+        scene.transforms.get(scene.renderables.entityAt(i));
+
+    residency.bindTexture(renderable.textureId);
+    setWorldMatrix(shaderProgram, transform.worldMatrix);
+    glDrawArrays(GL_TRIANGLES, renderable.firstVertex, renderable.vertexCount);
+  }
+}
+
+int runEcsBenchmark(int entityCount) {
+  // Orbiting entities, every other one also spinning
+  Scene scene;
+  scene.transforms.reserve(entityCount);
+  scene.orbits.reserve(entityCount);
+  scene.spins.reserve(entityCount / 2 + 1);
+  for (int i = 0; i < entityCount; ++i) {
+    Entity entity = scene.createEntity();
+    scene.addTransform(entity, vec3(0.0f));
+    OrbitComponent orbit = {1.0f + (i % 100) * 0.1f, i * 0.001f, 1.0f};
+    scene.orbits.add(entity, orbit);
+    if (i % 2 == 0) {
+      SpinComponent spin = {vec3(0.0f, 1.0f, 0.0f), 0.0f, 3.0f};
+      scene.spins.add(entity, spin);
+    }
+  }
+
+  // Packed component + entity arrays and the sparse lookup table
+  size_t perEntity = 2 * sizeof(Entity);
+  size_t componentBytes =
+      scene.transforms.size() * (sizeof(TransformComponent) + perEntity) +
+      scene.orbits.size() * (sizeof(OrbitComponent) + perEntity) +
+      scene.spins.size() * (sizeof(SpinComponent) + perEntity);
+  std::cout << "ECS benchmark: " << entityCount << " entities, "
+            << componentBytes / (1024 * 1024) << " MB of components"
+            << std::endl;
+
+  const int frames = 20;
+  const float dt = 1.0f / 60.0f;
+  int workerCount = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+  for (int pass = 0; pass < 2; ++pass) {
+    SystemScheduler scheduler(pass == 0 ? 0 : workerCount);
+    addSceneSystems(scheduler);
+    scheduler.run(scene, dt); // warm up
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; ++frame)
+      scheduler.run(scene, dt);
+    double milliseconds = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count() /
+                          frames;
+
+    if (pass == 0)
+      std::cout << "serial: ";
+    else
+      std::cout << "parallel (" << workerCount << " workers): ";
+    std::cout << milliseconds << " ms/frame, "
+              << milliseconds * 1e6 / entityCount << " ns/entity"
+              << std::endl;
+    scheduler.printStats(std::cout);
+  }
+
+  return 0;
+}